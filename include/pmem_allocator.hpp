@@ -22,7 +22,8 @@ struct PMemAllocatorHint {
   PMemAllocatorHint(uint64_t _segment_size, uint32_t _allocation_unit,
                     uint32_t _bg_thread_interval)
       : segment_size(_segment_size), allocation_unit(_allocation_unit),
-        bg_thread_interval(_bg_thread_interval) {
+        bg_thread_interval(_bg_thread_interval), punch_hole_free_segment(false),
+        prefetch(false) {
     max_common_allocation_size = _allocation_unit << 7;
   }
 
@@ -30,6 +31,37 @@ struct PMemAllocatorHint {
   uint32_t allocation_unit;
   float bg_thread_interval;
   uint64_t max_common_allocation_size;
+  // Release media of reclaimed free segments by MADV_REMOVE, only available in
+  // fsdax mode
+  bool punch_hole_free_segment;
+  // Background thread keeps a spare segment and a prefetched free entry list
+  // for recently missed block sizes of each access thread, so the allocation
+  // path rarely touches shared structures
+  bool prefetch;
+};
+
+// Per-allocation hint, describes how the allocated space will be used so the
+// allocator can place it properly
+struct PMemAllocationHint {
+  enum class Lifetime : uint8_t {
+    // Frequently allocated and freed, served by the common path: carved from
+    // the thread segment of its block size, and from freed space once that
+    // segment runs out
+    Short,
+    // Rarely freed, pack together in dedicated segments so that short-lived
+    // allocations don't fragment around them
+    Long,
+  };
+
+  PMemAllocationHint() : PMemAllocationHint(Lifetime::Short, 0) {}
+
+  PMemAllocationHint(Lifetime _lifetime, uint32_t _locality_group)
+      : lifetime(_lifetime), locality_group(_locality_group) {}
+
+  Lifetime lifetime;
+  // Allocations of a same non-zero locality group from a thread are placed
+  // adjacently, 0 means no locality requirement
+  uint32_t locality_group;
 };
 
 class PMemAllocator {
@@ -37,6 +69,25 @@ public:
   // Allocate a PMem space, return address and actually allocated space in bytes
   virtual PMemSpaceEntry Allocate(uint64_t size) = 0;
 
+  // Allocate a PMem space placed according to "hint"
+  virtual PMemSpaceEntry Allocate(uint64_t size,
+                                  const PMemAllocationHint &hint) = 0;
+
+  // Allocate a PMem space whose address is aligned to "alignment", which
+  // should be a power of 2. Return a null entry if the alignment can not be
+  // satisfied
+  virtual PMemSpaceEntry AllocateAligned(uint64_t size, uint64_t alignment) = 0;
+
+  virtual PMemSpaceEntry AllocateAligned(uint64_t size, uint64_t alignment,
+                                         const PMemAllocationHint &hint) = 0;
+
+  // Resize an allocated PMem space entry to "size" bytes, extend it in place if
+  // the adjacent space is free, otherwise move its data to a new space and
+  // free the old one. Return the resized entry, or a null entry if failed, in
+  // which case "entry" is still valid
+  virtual PMemSpaceEntry Reallocate(const PMemSpaceEntry &entry,
+                                    uint64_t size) = 0;
+
   // Free a PMem space entry. The entry should be allocated by this allocator
   virtual void Free(const PMemSpaceEntry &entry) = 0;
 
@@ -0,0 +1,62 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2021 Intel Corporation
+ */
+
+#include "instrumentation.hpp"
+
+#ifdef PMEM_ALLOCATOR_INSTRUMENTATION
+
+static const char *kLatencyPathNames[] = {
+    "allocate", "free", "reallocate", "refill", "segment allocation",
+    "reclaim"};
+
+static const char *kTraceEventNames[] = {
+    "refill",         "refill miss",       "spill",     "new segment",
+    "reuse segment",  "segment cas retry", "exhausted", "segment reclaimed",
+    "reallocate in place", "reallocate move"};
+
+static_assert(sizeof(kLatencyPathNames) / sizeof(kLatencyPathNames[0]) ==
+              (uint32_t)LatencyPath::NumPaths);
+static_assert(sizeof(kTraceEventNames) / sizeof(kTraceEventNames[0]) ==
+              (uint32_t)TraceEvent::NumEvents);
+
+void Instrumentation::Report(FILE *out) {
+  fprintf(out, "PMem allocator latency (ns):\n");
+  for (uint32_t path = 0; path < (uint32_t)LatencyPath::NumPaths; path++) {
+    uint64_t histogram[kLatencyBuckets] = {0};
+    uint64_t total = 0;
+    for (uint64_t i = 0; i < slots_.size(); i++) {
+      for (uint32_t b = 0; b < kLatencyBuckets; b++) {
+        uint64_t count =
+            slots_[i].latency[path][b].load(std::memory_order_relaxed);
+        histogram[b] += count;
+        total += count;
+      }
+    }
+    if (total == 0) {
+      continue;
+    }
+    fprintf(out, "  %s: %lu samples\n", kLatencyPathNames[path], total);
+    uint64_t accumulated = 0;
+    for (uint32_t b = 0; b < kLatencyBuckets; b++) {
+      if (histogram[b] == 0) {
+        continue;
+      }
+      accumulated += histogram[b];
+      // Bucket b holds latencies in [2^(b-1), 2^b)
+      fprintf(out, "    < %-12lu %12lu  %6.2f%%\n", 1UL << b, histogram[b],
+              accumulated * 100.0 / total);
+    }
+  }
+
+  fprintf(out, "PMem allocator events:\n");
+  for (uint32_t event = 0; event < (uint32_t)TraceEvent::NumEvents; event++) {
+    uint64_t total = 0;
+    for (uint64_t i = 0; i < slots_.size(); i++) {
+      total += slots_[i].events[event].load(std::memory_order_relaxed);
+    }
+    fprintf(out, "  %s: %lu\n", kTraceEventNames[event], total);
+  }
+}
+
+#endif
@@ -0,0 +1,172 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2021 Intel Corporation
+ */
+
+#pragma once
+
+// Allocator hot path instrumentation, enabled by compiling with
+// PMEM_ALLOCATOR_INSTRUMENTATION defined. When disabled, all the INSTRUMENT_*
+// macros expand to nothing.
+//
+// Recorded data:
+//  * per-path latency histograms with power of 2 nanosecond buckets
+//  * event counts
+//  * USDT tracepoints (provider "pmem_allocator") if <sys/sdt.h> is available,
+//    which can be attached by perf/bpftrace, e.g.
+//    perf probe -x libpmem_allocator.so sdt_pmem_allocator:NewSegment
+//
+// The allocator doesn't touch allocated space, so page faults on a fresh
+// segment happen in the caller; correlate them with the NewSegment (never used
+// segment) and ReuseSegment (reclaimed segment) tracepoints, whose arguments
+// are the segment address and size.
+
+#ifdef PMEM_ALLOCATOR_INSTRUMENTATION
+
+#include <stdio.h>
+#include <time.h>
+
+#include <atomic>
+
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define INSTRUMENT_TRACEPOINT(name, arg1, arg2)                                \
+  DTRACE_PROBE2(pmem_allocator, name, arg1, arg2)
+#else
+#define INSTRUMENT_TRACEPOINT(name, arg1, arg2)                                \
+  do {                                                                         \
+    (void)(arg1);                                                              \
+    (void)(arg2);                                                              \
+  } while (0)
+#endif
+
+#include "thread_manager.hpp"
+#include "utils.hpp"
+
+enum class LatencyPath : uint32_t {
+  Allocate = 0,
+  Free,
+  Reallocate,
+  // Fetch an entry list from pool to a thread cache, include pool lock wait
+  Refill,
+  // Allocate a new segment, include CAS retries on offset head
+  SegmentAllocation,
+  // Background segment reclamation
+  Reclaim,
+  NumPaths,
+};
+
+enum class TraceEvent : uint32_t {
+  Refill = 0,
+  RefillMiss,
+  Spill,
+  NewSegment,
+  ReuseSegment,
+  SegmentCASRetry,
+  Exhausted,
+  SegmentReclaimed,
+  ReallocateInPlace,
+  ReallocateMove,
+  NumEvents,
+};
+
+class Instrumentation {
+public:
+  static constexpr uint32_t kLatencyBuckets = 40;
+
+  // A slot per access thread, and a extra slot shared by background thread
+  // and threads without access thread id
+  Instrumentation(uint32_t max_access_threads)
+      : slots_(max_access_threads + 1) {}
+
+  static inline uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  }
+
+  inline void RecordLatency(LatencyPath path, uint64_t ns) {
+    uint32_t bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+    if (bucket >= kLatencyBuckets) {
+      bucket = kLatencyBuckets - 1;
+    }
+    increase(slot().latency[(uint32_t)path][bucket]);
+  }
+
+  inline void RecordEvent(TraceEvent event) {
+    increase(slot().events[(uint32_t)event]);
+  }
+
+  // Print merged histograms and event counts of all slots
+  void Report(FILE *out);
+
+private:
+  struct alignas(64) Slot {
+    Slot() {
+      for (auto &histogram : latency) {
+        for (auto &count : histogram) {
+          count.store(0, std::memory_order_relaxed);
+        }
+      }
+      for (auto &count : events) {
+        count.store(0, std::memory_order_relaxed);
+      }
+    }
+
+    Slot(const Slot &) : Slot() {}
+
+    std::atomic<uint64_t> latency[(uint32_t)LatencyPath::NumPaths]
+                                 [kLatencyBuckets];
+    std::atomic<uint64_t> events[(uint32_t)TraceEvent::NumEvents];
+  };
+
+  // Each slot is written by its owner thread only, except the shared slot
+  inline void increase(std::atomic<uint64_t> &count) {
+    if (access_thread.id >= 0 && access_thread.id < (int)slots_.size() - 1) {
+      count.store(count.load(std::memory_order_relaxed) + 1,
+                  std::memory_order_relaxed);
+    } else {
+      count.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  inline Slot &slot() {
+    int id = access_thread.id;
+    return slots_[id >= 0 && id < (int)slots_.size() - 1 ? id
+                                                         : slots_.size() - 1];
+  }
+
+  FixVector<Slot> slots_;
+};
+
+class ScopedLatency {
+public:
+  ScopedLatency(Instrumentation &instrumentation, LatencyPath path)
+      : instrumentation_(instrumentation), path_(path),
+        start_(Instrumentation::now_ns()) {}
+
+  ~ScopedLatency() {
+    instrumentation_.RecordLatency(path_, Instrumentation::now_ns() - start_);
+  }
+
+private:
+  Instrumentation &instrumentation_;
+  LatencyPath path_;
+  uint64_t start_;
+};
+
+#define INSTRUMENT_LATENCY(path)                                               \
+  ScopedLatency scoped_latency(instrumentation_, LatencyPath::path)
+#define INSTRUMENT_EVENT(event, arg1, arg2)                                    \
+  do {                                                                         \
+    instrumentation_.RecordEvent(TraceEvent::event);                           \
+    INSTRUMENT_TRACEPOINT(event, arg1, arg2);                                  \
+  } while (0)
+
+#else
+
+#define INSTRUMENT_LATENCY(path)
+#define INSTRUMENT_EVENT(event, arg1, arg2)                                    \
+  do {                                                                         \
+  } while (0)
+
+#endif
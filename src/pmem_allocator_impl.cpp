@@ -20,6 +20,11 @@ PMemAllocator *PMemAllocator::NewPMemAllocator(const std::string &pmem_file,
   if (hint != nullptr) {
     allocator_configs = *hint;
   }
+  if (devdax_mode && allocator_configs.punch_hole_free_segment) {
+    fprintf(stderr, "Punch hole of free segment is not supported in devdax "
+                    "mode, ignored\n");
+    allocator_configs.punch_hole_free_segment = false;
+  }
 
   int is_pmem;
   uint64_t mapped_size;
@@ -80,17 +85,19 @@ PMemAllocator *PMemAllocator::NewPMemAllocator(const std::string &pmem_file,
   return allocator;
 }
 
-void PMemAllocatorImpl::SpaceEntryPool::MoveEntryList(std::vector<void *> &src,
-                                                      uint32_t b_size) {
-  std::lock_guard<SpinMutex> lg(spins_[b_size]);
+template <typename Mutex>
+void PMemAllocatorImpl::SpaceEntryPool<Mutex>::MoveEntryList(
+    std::vector<void *> &src, uint32_t b_size) {
+  std::lock_guard<Mutex> lg(spins_[b_size]);
   assert(b_size < pool_.size());
   pool_[b_size].emplace_back();
   pool_[b_size].back().swap(src);
 }
 
-bool PMemAllocatorImpl::SpaceEntryPool::FetchEntryList(std::vector<void *> &dst,
-                                                       uint32_t b_size) {
-  std::lock_guard<SpinMutex> lg(spins_[b_size]);
+template <typename Mutex>
+bool PMemAllocatorImpl::SpaceEntryPool<Mutex>::FetchEntryList(
+    std::vector<void *> &dst, uint32_t b_size) {
+  std::lock_guard<Mutex> lg(spins_[b_size]);
   if (pool_[b_size].size() != 0) {
     dst.swap(pool_[b_size].back());
     pool_[b_size].pop_back();
@@ -99,6 +106,27 @@ bool PMemAllocatorImpl::SpaceEntryPool::FetchEntryList(std::vector<void *> &dst,
   return false;
 }
 
+template <typename Mutex>
+void PMemAllocatorImpl::SpaceEntryPool<Mutex>::ExtractEntries(
+    std::vector<void *> &dst, uint32_t b_size,
+    const std::function<bool(void *)> &match) {
+  std::lock_guard<Mutex> lg(spins_[b_size]);
+  auto &entry_lists = pool_[b_size];
+  for (size_t i = 0; i < entry_lists.size();) {
+    auto &list = entry_lists[i];
+    auto extracted_begin = std::stable_partition(
+        list.begin(), list.end(), [&](void *addr) { return !match(addr); });
+    dst.insert(dst.end(), extracted_begin, list.end());
+    list.erase(extracted_begin, list.end());
+    if (list.empty()) {
+      list.swap(entry_lists.back());
+      entry_lists.pop_back();
+    } else {
+      i++;
+    }
+  }
+}
+
 void PMemAllocatorImpl::BackgroundWork() {
   while (1) {
     if (closing_)
@@ -110,7 +138,7 @@ void PMemAllocatorImpl::BackgroundWork() {
       moving_list.clear();
       for (size_t b_size = 1; b_size < tc.freelists.size(); b_size++) {
         moving_list.clear();
-        std::unique_lock<SpinMutex> ul(tc.locks[b_size]);
+        std::unique_lock<AllocatorMutex> ul(tc.locks[b_size]);
 
         if (tc.freelists[b_size].size() >= kMinMovableListSize) {
           if (tc.freelists[b_size].size() >= kMinMovableListSize) {
@@ -118,10 +146,176 @@ void PMemAllocatorImpl::BackgroundWork() {
           }
         }
         if (moving_list.size() > 0) {
+          INSTRUMENT_EVENT(Spill, b_size, moving_list.size());
           pool_.MoveEntryList(moving_list, b_size);
         }
       }
     }
+    ReclaimSegments();
+    if (prefetch_) {
+      PrefetchForThreads();
+    }
+  }
+}
+
+void PMemAllocatorImpl::PrefetchForThreads() {
+  for (auto &tc : thread_cache_) {
+    for (size_t b_size = 1; b_size < tc.prefetch_slots.size(); b_size++) {
+      auto &slot = tc.prefetch_slots[b_size];
+      if (!slot.hot.load(std::memory_order_relaxed)) {
+        // Not missed since last top up, give the prepared space back so other
+        // block sizes and segment reclamation can use it
+        uint64_t offset =
+            slot.segment.exchange(kNullPmemOffset, std::memory_order_acquire);
+        if (offset != kNullPmemOffset) {
+          std::lock_guard<AllocatorMutex> lg(free_segments_lock_);
+          free_segments_.push_back(offset);
+        }
+        WithdrawPrefetchedList(slot, b_size, [](void *) { return true; });
+        continue;
+      }
+      slot.hot.store(false, std::memory_order_relaxed);
+      if (slot.state.load(std::memory_order_acquire) == PrefetchSlot::kEmpty) {
+        assert(slot.entries.empty());
+        if (pool_.FetchEntryList(slot.entries, b_size)) {
+          slot.state.store(PrefetchSlot::kReady, std::memory_order_release);
+        }
+      }
+      if (slot.segment.load(std::memory_order_relaxed) == kNullPmemOffset) {
+        uint64_t offset = FetchSegment();
+        if (offset != kNullPmemOffset) {
+          slot.segment.store(offset, std::memory_order_release);
+        }
+      }
+    }
+  }
+}
+
+void PMemAllocatorImpl::WithdrawPrefetchedList(
+    PrefetchSlot &slot, uint32_t b_size,
+    const std::function<bool(void *)> &match) {
+  if (!slot.Claim()) {
+    return;
+  }
+  FreeList withdrawn;
+  auto extracted_begin =
+      std::stable_partition(slot.entries.begin(), slot.entries.end(),
+                            [&](void *addr) { return !match(addr); });
+  withdrawn.insert(withdrawn.end(), extracted_begin, slot.entries.end());
+  slot.entries.erase(extracted_begin, slot.entries.end());
+  slot.state.store(slot.entries.empty() ? PrefetchSlot::kEmpty
+                                        : PrefetchSlot::kReady,
+                   std::memory_order_release);
+  if (withdrawn.size() > 0) {
+    pool_.MoveEntryList(withdrawn, b_size);
+  }
+}
+
+void PMemAllocatorImpl::ReclaimSegments() {
+  uint64_t num_segments =
+      std::min(offset_head_.load(std::memory_order_relaxed), pmem_size_) /
+      segment_size_;
+  std::vector<bool> candidates(num_segments, false);
+  bool found = false;
+  for (uint64_t i = 0; i < num_segments; i++) {
+    // Only reclaim segments that stay free and unused since last sweep, so we
+    // don't strip free space that its owner thread is reusing
+    uint64_t state = segment_live_blocks_[i].load(std::memory_order_relaxed);
+    if (live_blocks(state) == 0 && state == last_segment_live_blocks_[i]) {
+      candidates[i] = true;
+      found = true;
+    }
+    last_segment_live_blocks_[i] = state;
+  }
+  if (!found) {
+    return;
+  }
+  INSTRUMENT_LATENCY(Reclaim);
+
+  // Pull free space of candidate segments out of thread caches and pool
+  auto match = [&](void *addr) {
+    uint64_t index = segment_index(addr);
+    return index < num_segments && candidates[index];
+  };
+  FixVector<FreeList> extracted(max_classified_record_block_size_ + 1);
+  for (auto &tc : thread_cache_) {
+    for (size_t b_size = 1; b_size < tc.freelists.size(); b_size++) {
+      std::unique_lock<AllocatorMutex> ul(tc.locks[b_size]);
+      auto &freelist = tc.freelists[b_size];
+      // Keep order of remaining entries, so recently freed space is still
+      // reused first
+      auto extracted_begin =
+          std::stable_partition(freelist.begin(), freelist.end(),
+                                [&](void *addr) { return !match(addr); });
+      extracted[b_size].insert(extracted[b_size].end(), extracted_begin,
+                               freelist.end());
+      freelist.erase(extracted_begin, freelist.end());
+    }
+  }
+  // Entries parked in prefetch slots go back to pool first, so they can be
+  // extracted from pool
+  if (prefetch_) {
+    for (auto &tc : thread_cache_) {
+      for (size_t b_size = 1; b_size < tc.prefetch_slots.size(); b_size++) {
+        WithdrawPrefetchedList(tc.prefetch_slots[b_size], b_size, match);
+      }
+    }
+  }
+  for (size_t b_size = 1; b_size < extracted.size(); b_size++) {
+    pool_.ExtractEntries(extracted[b_size], b_size, match);
+  }
+
+  // Entry lists may move between thread caches and pool during extraction,
+  // so a segment is reclaimable only if all its space has been extracted,
+  // then no one else can hold any part of it
+  std::vector<uint64_t> extracted_size(num_segments, 0);
+  for (size_t b_size = 1; b_size < extracted.size(); b_size++) {
+    for (void *addr : extracted[b_size]) {
+      extracted_size[segment_index(addr)] += b_size * block_size_;
+    }
+  }
+  std::vector<uint64_t> reclaimed;
+  for (uint64_t i = 0; i < num_segments; i++) {
+    if (candidates[i]) {
+      assert(extracted_size[i] <= segment_size_);
+      if (extracted_size[i] == segment_size_) {
+        segment_live_blocks_[i].store(segment_size_ / block_size_,
+                                      std::memory_order_relaxed);
+        reclaimed.push_back(i * segment_size_);
+      } else {
+        candidates[i] = false;
+      }
+    }
+  }
+
+  // Return space of unreclaimable segments to pool
+  for (size_t b_size = 1; b_size < extracted.size(); b_size++) {
+    auto &list = extracted[b_size];
+    list.erase(std::remove_if(list.begin(), list.end(), match), list.end());
+    if (list.size() > 0) {
+      pool_.MoveEntryList(list, b_size);
+    }
+  }
+
+#ifdef PMEM_ALLOCATOR_INSTRUMENTATION
+  for (uint64_t offset : reclaimed) {
+    INSTRUMENT_EVENT(SegmentReclaimed, pmem_ + offset, segment_size_);
+  }
+#endif
+
+  if (punch_hole_free_segment_) {
+    for (uint64_t offset : reclaimed) {
+      if (madvise(pmem_ + offset, segment_size_, MADV_REMOVE) != 0) {
+        fprintf(stderr, "Punch hole of free segment failed: %s\n",
+                strerror(errno));
+      }
+    }
+  }
+
+  if (reclaimed.size() > 0) {
+    std::lock_guard<AllocatorMutex> lg(free_segments_lock_);
+    free_segments_.insert(free_segments_.end(), reclaimed.begin(),
+                          reclaimed.end());
   }
 }
 
@@ -132,18 +326,38 @@ PMemAllocatorImpl::PMemAllocatorImpl(char *pmem, uint64_t pmem_size,
       thread_manager_(std::make_shared<ThreadManager>(max_access_threads)),
       block_size_(hint.allocation_unit), segment_size_(hint.segment_size),
       bg_thread_interval_(hint.bg_thread_interval),
+      punch_hole_free_segment_(hint.punch_hole_free_segment),
+      prefetch_(hint.prefetch && bg_thread_interval_ > 0),
       max_classified_record_block_size_(
           calculate_block_size(hint.max_common_allocation_size)),
       pool_(max_classified_record_block_size_),
+      segment_live_blocks_(pmem_size_ / segment_size_),
+      last_segment_live_blocks_(pmem_size_ / segment_size_,
+                                segment_size_ / block_size_),
       thread_cache_(max_access_threads, max_classified_record_block_size_),
-      offset_head_(0), closing_(false) {
+      offset_head_(0), closing_(false)
+#ifdef PMEM_ALLOCATOR_INSTRUMENTATION
+      ,
+      instrumentation_(max_access_threads)
+#endif
+{
   init_data_size_2_block_size();
+  for (uint64_t i = 0; i < segment_live_blocks_.size(); i++) {
+    segment_live_blocks_[i].store(segment_size_ / block_size_,
+                                  std::memory_order_relaxed);
+  }
+  // Segments start at multiples of segment size from the mapped address, so
+  // they are aligned to the lowest set bit of both
+  uint64_t base = (uint64_t)pmem_;
+  max_alignment_ =
+      std::min(segment_size_ & (~segment_size_ + 1), base & (~base + 1));
   if (bg_thread_interval_ > 0) {
     bg_threads_.emplace_back(&PMemAllocatorImpl::BackgroundWork, this);
   }
 }
 
 void PMemAllocatorImpl::Free(const PMemSpaceEntry &entry) {
+  INSTRUMENT_LATENCY(Free);
   if (!MaybeInitAccessThread()) {
     fprintf(stderr, "too many thread access allocator!\n");
     std::abort();
@@ -153,12 +367,123 @@ void PMemAllocatorImpl::Free(const PMemSpaceEntry &entry) {
     assert(entry.size % block_size_ == 0);
     auto b_size = entry.size / block_size_;
     auto &thread_cache = thread_cache_[access_thread.id];
-    std::unique_lock<SpinMutex> ul(thread_cache.locks[b_size]);
+    std::unique_lock<AllocatorMutex> ul(thread_cache.locks[b_size]);
     assert(b_size < thread_cache.freelists.size());
     // Conflict with bg thread happens only if free entries more than
     // kMinMovableListSize
     thread_cache.freelists[b_size].emplace_back(entry.addr);
+    mark_freed(entry.addr, entry.size);
+  }
+}
+
+bool PMemAllocatorImpl::ExtendInPlace(
+    ThreadCache<AllocatorMutex> &thread_cache, const PMemSpaceEntry &entry,
+    uint64_t extension) {
+  char *end = (char *)entry.addr + entry.size;
+  // A block never spans segments
+  if (segment_index(end) != segment_index(entry.addr)) {
+    return false;
+  }
+
+  // Entry is followed by the remaining space of a thread segment, which is
+  // still counted as live, so just move the segment start
+  auto extend_by_segment = [&](Segment &segment) {
+    if (segment.addr == end && segment.size >= extension) {
+      segment.addr = end + extension;
+      segment.size -= extension;
+      return true;
+    }
+    return false;
+  };
+  for (uint64_t i = 1; i < thread_cache.segments.size(); i++) {
+    if (extend_by_segment(thread_cache.segments[i])) {
+      return true;
+    }
+  }
+  for (uint64_t i = 0; i < thread_cache.hinted_segments.size(); i++) {
+    if (extend_by_segment(thread_cache.hinted_segments[i])) {
+      return true;
+    }
+  }
+
+  // Look for a free neighbor no larger than the resized entry in the most
+  // recently freed entries
+  uint32_t extension_b_size = extension / block_size_;
+  uint32_t max_b_size = (entry.size + extension) / block_size_;
+  for (uint32_t i = extension_b_size; i <= max_b_size; i++) {
+    void *neighbor = nullptr;
+    {
+      std::unique_lock<AllocatorMutex> ul(thread_cache.locks[i]);
+      auto &freelist = thread_cache.freelists[i];
+      uint64_t scan = std::min(freelist.size(), kMaxNeighborFreeListScan);
+      for (uint64_t k = 1; k <= scan; k++) {
+        if (freelist[freelist.size() - k] == end) {
+          std::swap(freelist[freelist.size() - k], freelist.back());
+          freelist.pop_back();
+          neighbor = end;
+          mark_allocated(neighbor, i * block_size_);
+          break;
+        }
+      }
+    }
+    if (neighbor != nullptr) {
+      // Return the space beyond the resized entry
+      RecycleSpace(thread_cache, PMemSpaceEntry{end + extension,
+                                                i * block_size_ - extension});
+      return true;
+    }
   }
+  return false;
+}
+
+PMemSpaceEntry PMemAllocatorImpl::Reallocate(const PMemSpaceEntry &entry,
+                                             uint64_t size) {
+  INSTRUMENT_LATENCY(Reallocate);
+  PMemSpaceEntry space_entry;
+  if (!MaybeInitAccessThread()) {
+    fprintf(stderr, "too many thread access allocator!\n");
+    return space_entry;
+  }
+  // Check size before converting it to a 32 bits block size
+  if (size == 0 || size > max_classified_record_block_size_ * block_size_) {
+    fprintf(stderr, "reallocating size is 0 or larger than max allocation "
+                    "size\n");
+    return space_entry;
+  }
+  uint32_t b_size = size_2_block_size(size);
+  uint64_t aligned_size = b_size * block_size_;
+  auto &thread_cache = thread_cache_[access_thread.id];
+  assert(aligned_size > 0 && b_size < thread_cache.freelists.size());
+  // Not calling Allocate() here, so the allocation is recorded as reallocate
+  // latency only
+  if (entry.addr == nullptr || entry.size == 0) {
+    return AllocateBlocks(thread_cache, b_size, 1);
+  }
+  assert(entry.size % block_size_ == 0);
+
+  // Shrink in place
+  if (aligned_size <= entry.size) {
+    RecycleSpace(thread_cache,
+                 PMemSpaceEntry{(char *)entry.addr + aligned_size,
+                                entry.size - aligned_size});
+    return PMemSpaceEntry{entry.addr, aligned_size};
+  }
+
+  if (ExtendInPlace(thread_cache, entry, aligned_size - entry.size)) {
+    INSTRUMENT_EVENT(ReallocateInPlace, entry.addr, aligned_size);
+    return PMemSpaceEntry{entry.addr, aligned_size};
+  }
+
+  // Move to a new space, bypass CPU cache as the copied data is unlikely to
+  // be read soon
+  space_entry = AllocateBlocks(thread_cache, b_size, 1);
+  if (space_entry.addr != nullptr) {
+    INSTRUMENT_EVENT(ReallocateMove, entry.addr, space_entry.addr);
+    pmem_memcpy(space_entry.addr, entry.addr, entry.size,
+                PMEM_F_MEM_NONTEMPORAL);
+    Free(entry);
+  }
+  return space_entry;
 }
 
 void PMemAllocatorImpl::PopulateSpace() {
@@ -185,74 +510,278 @@ PMemAllocatorImpl::~PMemAllocatorImpl() {
   for (auto &t : bg_threads_) {
     t.join();
   }
+#ifdef PMEM_ALLOCATOR_INSTRUMENTATION
+  instrumentation_.Report(stdout);
+#endif
   pmem_unmap(pmem_, pmem_size_);
 }
 
 bool PMemAllocatorImpl::AllocateSegmentSpace(PMemSpaceEntry *segment_entry) {
-  uint64_t offset;
+  uint64_t offset = FetchSegment();
+  if (offset == kNullPmemOffset) {
+    return false;
+  }
+  RecycleSpace(thread_cache_[access_thread.id], *segment_entry);
+  *segment_entry = PMemSpaceEntry{offset2addr(offset), segment_size_};
+  return true;
+}
+
+uint64_t PMemAllocatorImpl::FetchSegment() {
+  INSTRUMENT_LATENCY(SegmentAllocation);
+  uint64_t offset = kNullPmemOffset;
+  // Reuse reclaimed segments first
+  {
+    std::lock_guard<AllocatorMutex> lg(free_segments_lock_);
+    if (!free_segments_.empty()) {
+      offset = free_segments_.back();
+      free_segments_.pop_back();
+    }
+  }
+  if (offset != kNullPmemOffset) {
+    INSTRUMENT_EVENT(ReuseSegment, pmem_ + offset, segment_size_);
+    return offset;
+  }
+
   while (1) {
     offset = offset_head_.load(std::memory_order_relaxed);
     if (offset < pmem_size_) {
       if (offset_head_.compare_exchange_strong(offset,
                                                offset + segment_size_)) {
         if (offset > pmem_size_ - segment_size_) {
-          return false;
+          break;
         }
-        Free(*segment_entry);
-        *segment_entry = PMemSpaceEntry{offset2addr(offset), segment_size_};
-        return true;
+        INSTRUMENT_EVENT(NewSegment, pmem_ + offset, segment_size_);
+        return offset;
       }
+      INSTRUMENT_EVENT(SegmentCASRetry, offset, 0);
       continue;
     }
+    break;
+  }
+
+  // Take spare segments prepared for other block sizes before giving up
+  if (prefetch_) {
+    for (auto &tc : thread_cache_) {
+      for (size_t b_size = 1; b_size < tc.prefetch_slots.size(); b_size++) {
+        offset = tc.prefetch_slots[b_size].segment.exchange(
+            kNullPmemOffset, std::memory_order_acquire);
+        if (offset != kNullPmemOffset) {
+          INSTRUMENT_EVENT(ReuseSegment, pmem_ + offset, segment_size_);
+          return offset;
+        }
+      }
+    }
+  }
+  INSTRUMENT_EVENT(Exhausted, offset_head_.load(std::memory_order_relaxed),
+                   pmem_size_);
+  return kNullPmemOffset;
+}
+
+bool PMemAllocatorImpl::TakePrefetchedList(
+    ThreadCache<AllocatorMutex> &thread_cache, uint32_t b_size) {
+  auto &slot = thread_cache.prefetch_slots[b_size];
+  slot.hot.store(true, std::memory_order_relaxed);
+  if (slot.Claim()) {
+    assert(thread_cache.freelists[b_size].empty());
+    // The empty free list is handed back to background thread
+    thread_cache.freelists[b_size].swap(slot.entries);
+    slot.state.store(PrefetchSlot::kEmpty, std::memory_order_release);
+    return true;
+  }
+  return false;
+}
+
+bool PMemAllocatorImpl::TakeSpareSegment(
+    ThreadCache<AllocatorMutex> &thread_cache, uint32_t b_size) {
+  auto &slot = thread_cache.prefetch_slots[b_size];
+  slot.hot.store(true, std::memory_order_relaxed);
+  uint64_t offset =
+      slot.segment.exchange(kNullPmemOffset, std::memory_order_acquire);
+  if (offset == kNullPmemOffset) {
     return false;
   }
+  RecycleSpace(thread_cache, thread_cache.segments[b_size]);
+  thread_cache.segments[b_size] = Segment{offset2addr(offset), segment_size_};
+  return true;
 }
 
-PMemSpaceEntry PMemAllocatorImpl::Allocate(uint64_t size) {
-  PMemSpaceEntry space_entry;
-  if (!MaybeInitAccessThread()) {
-    fprintf(stderr, "too many thread access allocator!\n");
-    return space_entry;
+void PMemAllocatorImpl::RecycleSpace(ThreadCache<AllocatorMutex> &thread_cache,
+                                     const PMemSpaceEntry &entry) {
+  char *addr = (char *)entry.addr;
+  uint64_t size = entry.size;
+  assert(size % block_size_ == 0);
+  while (size > 0 && addr != nullptr) {
+    uint64_t b_size = std::min<uint64_t>(size / block_size_,
+                                         max_classified_record_block_size_);
+    std::unique_lock<AllocatorMutex> ul(thread_cache.locks[b_size]);
+    thread_cache.freelists[b_size].emplace_back(addr);
+    mark_freed(addr, b_size * block_size_);
+    addr += b_size * block_size_;
+    size -= b_size * block_size_;
   }
-  uint32_t b_size = size_2_block_size(size);
-  uint32_t aligned_size = b_size * block_size_;
-  // Now the requested block size should smaller than segment size
-  if (aligned_size > segment_size_ || aligned_size == 0) {
-    fprintf(stderr,
-            "allocating size is 0 or larger than PMem allocator segment\n");
-    return space_entry;
+}
+
+PMemSpaceEntry
+PMemAllocatorImpl::CarveSegment(ThreadCache<AllocatorMutex> &thread_cache,
+                                Segment &segment, uint64_t size,
+                                uint64_t alignment) {
+  uint64_t padding = align_padding(segment.addr, alignment);
+  assert(segment.size >= padding + size);
+  if (padding > 0) {
+    RecycleSpace(thread_cache, PMemSpaceEntry{segment.addr, padding});
+    segment.addr = (char *)segment.addr + padding;
+    segment.size -= padding;
   }
-  auto &thread_cache = thread_cache_[access_thread.id];
+  PMemSpaceEntry space_entry{segment.addr, size};
+  segment.size -= size;
+  segment.addr = (char *)segment.addr + size;
+  return space_entry;
+}
+
+PMemSpaceEntry
+PMemAllocatorImpl::AllocateBlocks(ThreadCache<AllocatorMutex> &thread_cache,
+                                  uint32_t b_size, uint64_t alignment) {
+  PMemSpaceEntry space_entry;
+  uint64_t aligned_size = b_size * block_size_;
   for (auto i = b_size; i < thread_cache.freelists.size(); i++) {
-    if (thread_cache.segments[i].size < aligned_size) {
+    if (thread_cache.segments[i].size <
+        aligned_size +
+            align_padding(thread_cache.segments[i].addr, alignment)) {
       // Fetch free list from pool
       {
-        std::unique_lock<SpinMutex> ul(thread_cache.locks[i]);
-        if (thread_cache.freelists[i].empty()) {
-          pool_.FetchEntryList(thread_cache.freelists[i], i);
+        std::unique_lock<AllocatorMutex> ul(thread_cache.locks[i]);
+        auto &freelist = thread_cache.freelists[i];
+        if (freelist.empty() && prefetch_) {
+          TakePrefetchedList(thread_cache, i);
         }
-        // Get space from free list
-        if (thread_cache.freelists[i].size() > 0) {
-          space_entry.addr = thread_cache.freelists[i].back();
-          space_entry.size = i * block_size_;
-          thread_cache.freelists[i].pop_back();
-          break;
+        if (freelist.empty()) {
+          INSTRUMENT_LATENCY(Refill);
+          if (pool_.FetchEntryList(freelist, i)) {
+            INSTRUMENT_EVENT(Refill, i, freelist.size());
+          } else {
+            INSTRUMENT_EVENT(RefillMiss, i, 0);
+          }
+        }
+        // Get space from free list, look for an aligned entry near the back
+        // if alignment required
+        uint64_t scan = std::min(
+            freelist.size(), alignment > 1 ? kMaxAlignedFreeListScan : 1);
+        for (uint64_t k = 1; k <= scan; k++) {
+          void *addr = freelist[freelist.size() - k];
+          if (align_padding(addr, alignment) == 0) {
+            std::swap(freelist[freelist.size() - k], freelist.back());
+            freelist.pop_back();
+            space_entry.addr = addr;
+            space_entry.size = i * block_size_;
+            mark_allocated(space_entry.addr, space_entry.size);
+            return space_entry;
+          }
         }
       }
       // Allocate a new segment for requesting block size
-      if (!AllocateSegmentSpace(&thread_cache.segments[b_size])) {
+      if (!(prefetch_ && TakeSpareSegment(thread_cache, b_size)) &&
+          !AllocateSegmentSpace(&thread_cache.segments[b_size])) {
         continue;
       } else {
         i = b_size;
       }
+      if (thread_cache.segments[i].size <
+          aligned_size +
+              align_padding(thread_cache.segments[i].addr, alignment)) {
+        // Even a new segment can't satisfy the alignment
+        return space_entry;
+      }
     }
-    assert(thread_cache.segments[i].size >= aligned_size);
-    space_entry.addr = thread_cache.segments[i].addr;
-    space_entry.size = aligned_size;
-    thread_cache.segments[i].size -= aligned_size;
-    thread_cache.segments[i].addr =
-        (char *)thread_cache.segments[i].addr + aligned_size;
-    break;
+    return CarveSegment(thread_cache, thread_cache.segments[i], aligned_size,
+                        alignment);
   }
   return space_entry;
 }
+
+PMemSpaceEntry PMemAllocatorImpl::AllocateHintedBlocks(
+    ThreadCache<AllocatorMutex> &thread_cache, uint64_t aligned_size,
+    uint64_t alignment, const PMemAllocationHint &hint) {
+  uint32_t slot = hint.locality_group == 0
+                      ? 0
+                      : 1 + (hint.locality_group - 1) % kLocalityGroupSlots;
+  Segment &segment = thread_cache.hinted_segments[slot];
+  if (segment.size < aligned_size + align_padding(segment.addr, alignment)) {
+    if (!AllocateSegmentSpace(&segment) ||
+        segment.size < aligned_size + align_padding(segment.addr, alignment)) {
+      return PMemSpaceEntry();
+    }
+  }
+  return CarveSegment(thread_cache, segment, aligned_size, alignment);
+}
+
+PMemSpaceEntry PMemAllocatorImpl::Allocate(uint64_t size) {
+  INSTRUMENT_LATENCY(Allocate);
+  if (!MaybeInitAccessThread()) {
+    fprintf(stderr, "too many thread access allocator!\n");
+    return PMemSpaceEntry();
+  }
+  return AllocateWithHint(size, 1, PMemAllocationHint());
+}
+
+PMemSpaceEntry PMemAllocatorImpl::Allocate(uint64_t size,
+                                           const PMemAllocationHint &hint) {
+  INSTRUMENT_LATENCY(Allocate);
+  if (!MaybeInitAccessThread()) {
+    fprintf(stderr, "too many thread access allocator!\n");
+    return PMemSpaceEntry();
+  }
+  return AllocateWithHint(size, 1, hint);
+}
+
+PMemSpaceEntry PMemAllocatorImpl::AllocateAligned(uint64_t size,
+                                                  uint64_t alignment) {
+  return AllocateAligned(size, alignment, PMemAllocationHint());
+}
+
+PMemSpaceEntry
+PMemAllocatorImpl::AllocateAligned(uint64_t size, uint64_t alignment,
+                                   const PMemAllocationHint &hint) {
+  INSTRUMENT_LATENCY(Allocate);
+  PMemSpaceEntry space_entry;
+  if (!MaybeInitAccessThread()) {
+    fprintf(stderr, "too many thread access allocator!\n");
+    return space_entry;
+  }
+  uint64_t normalized_alignment = normalize_alignment(alignment);
+  if (normalized_alignment == 0) {
+    fprintf(stderr, "allocating alignment %lu is not supported\n", alignment);
+    return space_entry;
+  }
+  return AllocateWithHint(size, normalized_alignment, hint);
+}
+
+PMemSpaceEntry
+PMemAllocatorImpl::AllocateWithHint(uint64_t size, uint64_t alignment,
+                                    const PMemAllocationHint &hint) {
+  PMemSpaceEntry space_entry;
+  // Now the requested block size should smaller than segment size
+  if (size > segment_size_) {
+    fprintf(stderr,
+            "allocating size is 0 or larger than PMem allocator segment\n");
+    return space_entry;
+  }
+  uint32_t b_size = size_2_block_size(size);
+  uint32_t aligned_size = b_size * block_size_;
+  if (aligned_size > segment_size_ || aligned_size == 0) {
+    fprintf(stderr,
+            "allocating size is 0 or larger than PMem allocator segment\n");
+    return space_entry;
+  }
+  auto &thread_cache = thread_cache_[access_thread.id];
+  if (b_size < thread_cache.freelists.size() &&
+      (hint.lifetime == PMemAllocationHint::Lifetime::Long ||
+       hint.locality_group != 0)) {
+    space_entry =
+        AllocateHintedBlocks(thread_cache, aligned_size, alignment, hint);
+    if (space_entry.addr != nullptr) {
+      return space_entry;
+    }
+  }
+  // Fall back to common path if hinted segment is not available
+  return AllocateBlocks(thread_cache, b_size, alignment);
+}
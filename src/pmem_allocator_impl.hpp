@@ -9,21 +9,41 @@
 
 #include <assert.h>
 #include <atomic>
+#include <functional>
 #include <memory>
 #include <set>
 #include <thread>
 #include <unordered_map>
 #include <vector>
 
+#include "instrumentation.hpp"
 #include "pmem_allocator.hpp"
 #include "thread_manager.hpp"
 
 constexpr uint64_t kNullPmemOffset = UINT64_MAX;
 constexpr uint64_t kMinMovableListSize = 8;
+// Number of per-thread segments dedicated to locality groups, groups are
+// mapped to them by modulo
+constexpr uint32_t kLocalityGroupSlots = 8;
+// Max number of free list entries checked while looking for an aligned entry
+constexpr uint64_t kMaxAlignedFreeListScan = 16;
+// Max number of recently freed entries of a free list checked while looking
+// for a free neighbor to extend a reallocated entry
+constexpr uint64_t kMaxNeighborFreeListScan = 16;
+// Unit of reuse count in segment live blocks
+constexpr uint64_t kSegmentReuse = 1ULL << 32;
 
 using FreeList = std::vector<void *>;
 using Segment = PMemSpaceEntry;
 
+// Lock policy of allocator critical sections (entry pool and thread cache
+// free lists), can be switched at build time to benchmark alternatives, e.g.
+// -DPMEM_ALLOCATOR_MUTEX=SpinMutex
+#ifndef PMEM_ALLOCATOR_MUTEX
+#define PMEM_ALLOCATOR_MUTEX BackoffMutex
+#endif
+using AllocatorMutex = PMEM_ALLOCATOR_MUTEX;
+
 // Manage allocation/de-allocation of PMem space at block unit
 //
 // PMem space consists of several segment, and a segment is consists of
@@ -42,6 +62,17 @@ public:
   // Allocate a PMem space, return address and actually allocated space in bytes
   PMemSpaceEntry Allocate(uint64_t size) override;
 
+  PMemSpaceEntry Allocate(uint64_t size,
+                          const PMemAllocationHint &hint) override;
+
+  PMemSpaceEntry AllocateAligned(uint64_t size, uint64_t alignment) override;
+
+  PMemSpaceEntry AllocateAligned(uint64_t size, uint64_t alignment,
+                                 const PMemAllocationHint &hint) override;
+
+  PMemSpaceEntry Reallocate(const PMemSpaceEntry &entry,
+                            uint64_t size) override;
+
   // Free a PMem space entry. The entry should be allocated by this allocator
   void Free(const PMemSpaceEntry &entry) override;
 
@@ -86,7 +117,7 @@ private:
   //    ...
   // max_block_size   --------   list1
   //                    |-----   list2
-  class SpaceEntryPool {
+  template <typename Mutex> class SpaceEntryPool {
   public:
     SpaceEntryPool(uint32_t max_classified_b_size)
         : pool_(max_classified_b_size + 1), spins_(max_classified_b_size + 1) {}
@@ -98,10 +129,15 @@ private:
     // try to fetch b_size free space entries from a entry list of pool to dst
     bool FetchEntryList(std::vector<void *> &dst, uint32_t b_size);
 
+    // move all b_size free space entries that satisfy "match" from pool to dst
+    void ExtractEntries(std::vector<void *> &dst, uint32_t b_size,
+                        const std::function<bool(void *)> &match);
+
   private:
     FixVector<std::vector<FreeList>> pool_;
-    // Entry lists of a same block size guarded by a spin lock
-    FixVector<SpinMutex> spins_;
+    // Entry lists of a same block size guarded by a lock, each lock occupies
+    // a dedicated cache line to avoid false sharing between block sizes
+    FixVector<CacheAlignedMutex<Mutex>> spins_;
   };
 
   inline bool MaybeInitAccessThread() {
@@ -122,13 +158,46 @@ private:
     return offset < pmem_size_ && offset != kNullPmemOffset;
   }
 
+  // Space prepared by background thread for a block size of a thread cache,
+  // handed over without locking:
+  //
+  // * "segment" is set by background thread while empty, and taken by the
+  // access thread or a thread running out of segments with an exchange
+  // * "entries" is owned by background thread while "state" is kEmpty. Once
+  // kReady, either the access thread or background thread (to take it back)
+  // claims it by switching "state" to kTaken, and the claimer resets "state"
+  // after done
+  struct alignas(64) PrefetchSlot {
+    static constexpr uint8_t kEmpty = 0;
+    static constexpr uint8_t kReady = 1;
+    static constexpr uint8_t kTaken = 2;
+
+    PrefetchSlot() : segment(kNullPmemOffset), state(kEmpty), hot(false) {}
+
+    PrefetchSlot(const PrefetchSlot &s) : PrefetchSlot() {}
+
+    bool Claim() {
+      uint8_t expected = kReady;
+      return state.compare_exchange_strong(expected, kTaken,
+                                           std::memory_order_acquire);
+    }
+
+    std::atomic<uint64_t> segment;
+    std::atomic<uint8_t> state;
+    // Set by access thread while it misses space of the block size
+    std::atomic<bool> hot;
+    FreeList entries;
+  };
+
   // Write threads cache a dedicated PMem segment and a free space to
   // avoid contention
-  struct alignas(64) ThreadCache {
+  template <typename Mutex> struct alignas(64) ThreadCache {
     ThreadCache(uint32_t max_classified_block_size)
         : freelists(max_classified_block_size + 1),
           segments(max_classified_block_size + 1),
-          locks(max_classified_block_size + 1) {}
+          hinted_segments(kLocalityGroupSlots + 1),
+          locks(max_classified_block_size + 1),
+          prefetch_slots(max_classified_block_size + 1) {}
 
     // A array of array to store freed space, the space size is aligned to
     // block_size_, each array corresponding to a dedicated block size which is
@@ -137,16 +206,128 @@ private:
     // Thread own segments, each segment corresponding to a dedicated block size
     // which is equal to its index
     FixVector<Segment> segments;
-    // Protect freelists;
-    FixVector<SpinMutex> locks;
-
-    char padding[64 - sizeof(freelists) - sizeof(segments) - sizeof(locks)];
+    // Thread own segments for hinted allocations, shared by all block sizes.
+    // Index 0 serves long-lived allocations, index i serves locality groups
+    // mapped to slot i
+    FixVector<Segment> hinted_segments;
+    // Protect freelists, each lock occupies a dedicated cache line
+    FixVector<CacheAlignedMutex<Mutex>> locks;
+    // Used in prefetch mode, each corresponding to a dedicated block size
+    FixVector<PrefetchSlot> prefetch_slots;
   };
 
-  static_assert(sizeof(ThreadCache) % 64 == 0);
-
+  static_assert(sizeof(ThreadCache<AllocatorMutex>) % 64 == 0);
+
+  // Allocate b_size blocks whose address is aligned to "alignment" from
+  // thread cache, alignment 1 means no alignment requirement
+  PMemSpaceEntry AllocateBlocks(ThreadCache<AllocatorMutex> &thread_cache,
+                                uint32_t b_size, uint64_t alignment);
+
+  // Allocate "size" bytes placed according to "hint" for the access thread,
+  // "alignment" should be normalized by normalize_alignment()
+  PMemSpaceEntry AllocateWithHint(uint64_t size, uint64_t alignment,
+                                  const PMemAllocationHint &hint);
+
+  // Allocate aligned_size bytes from a hinted segment of thread cache
+  PMemSpaceEntry
+  AllocateHintedBlocks(ThreadCache<AllocatorMutex> &thread_cache,
+                       uint64_t aligned_size, uint64_t alignment,
+                       const PMemAllocationHint &hint);
+
+  // Carve "size" bytes aligned to "alignment" from the front of "segment",
+  // skipped padding is recycled to thread cache free lists
+  PMemSpaceEntry CarveSegment(ThreadCache<AllocatorMutex> &thread_cache,
+                              Segment &segment, uint64_t size,
+                              uint64_t alignment);
+
+  // Try to extend "entry" by "extension" bytes with the adjacent space, which
+  // is either the remaining space of a thread segment or a free entry in
+  // thread cache free lists
+  bool ExtendInPlace(ThreadCache<AllocatorMutex> &thread_cache,
+                     const PMemSpaceEntry &entry, uint64_t extension);
+
+  // Put a space of arbitrary block aligned size to thread cache free lists,
+  // space larger than the max classified block size is split
+  void RecycleSpace(ThreadCache<AllocatorMutex> &thread_cache,
+                    const PMemSpaceEntry &entry);
+
+  // Replace thread segment of "segment_entry" by a new segment, the remaining
+  // space of the old one is recycled
   bool AllocateSegmentSpace(PMemSpaceEntry *segment_entry);
 
+  // Get a free segment from reclaimed segments, unallocated space or spare
+  // segments of prefetch slots, return its offset or kNullPmemOffset if PMem
+  // space exhausted
+  uint64_t FetchSegment();
+
+  // Take the entry list prefetched for b_size, should hold the b_size lock of
+  // thread cache and the free list should be empty
+  bool TakePrefetchedList(ThreadCache<AllocatorMutex> &thread_cache,
+                          uint32_t b_size);
+
+  // Replace the b_size thread segment by the prefetched spare segment
+  bool TakeSpareSegment(ThreadCache<AllocatorMutex> &thread_cache,
+                        uint32_t b_size);
+
+  // Top up prefetch slots of hot block sizes of all thread caches, and take
+  // space back from slots no longer hot. Executed by background thread
+  void PrefetchForThreads();
+
+  // Move the prefetched entries of "slot" that satisfy "match" to pool, skip
+  // if the entries are being taken by the access thread. Executed by
+  // background thread
+  void WithdrawPrefetchedList(PrefetchSlot &slot, uint32_t b_size,
+                              const std::function<bool(void *)> &match);
+
+  // Return segments whose space are all in free lists to the free segment
+  // list, so they can be reused by any block size. Executed by background
+  // thread
+  void ReclaimSegments();
+
+  // Free space entries are counted out of the live blocks of their segment,
+  // the live blocks of a segment reach 0 once all its space are in free lists.
+  // Taking space from free lists also bumps the reuse count in high bits, so
+  // background thread can tell if a free segment has been reused between two
+  // sweeps
+  inline void mark_allocated(void *addr, uint64_t size) {
+    segment_live_blocks_[segment_index(addr)].fetch_add(
+        kSegmentReuse + size / block_size_, std::memory_order_relaxed);
+  }
+
+  inline void mark_freed(void *addr, uint64_t size) {
+    segment_live_blocks_[segment_index(addr)].fetch_sub(
+        size / block_size_, std::memory_order_relaxed);
+  }
+
+  static inline uint32_t live_blocks(uint64_t segment_state) {
+    return segment_state & (kSegmentReuse - 1);
+  }
+
+  inline uint64_t segment_index(const void *addr) {
+    return ((char *)addr - pmem_) / segment_size_;
+  }
+
+  // Check validity of a requested alignment and normalize it, return 0 if the
+  // alignment can not be satisfied
+  inline uint64_t normalize_alignment(uint64_t alignment) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 ||
+        alignment > max_alignment_) {
+      return 0;
+    }
+    if (alignment <= block_size_) {
+      return block_size_ % alignment == 0 ? 1 : 0;
+    }
+    return alignment % block_size_ == 0 ? alignment : 0;
+  }
+
+  inline uint64_t align_padding(const void *addr, uint64_t alignment) {
+    if (alignment <= 1) {
+      return 0;
+    }
+    uint64_t misalignment = (uint64_t)addr & (alignment - 1);
+    return misalignment == 0 ? 0 : alignment - misalignment;
+  }
+
   void init_data_size_2_block_size() {
     data_size_2_block_size_.resize(4096);
     for (size_t i = 0; i < data_size_2_block_size_.size(); i++) {
@@ -170,17 +351,37 @@ private:
   const uint64_t segment_size_;
   const uint32_t block_size_;
   const uint32_t max_classified_record_block_size_;
-  const uint32_t bg_thread_interval_;
+  const float bg_thread_interval_;
+
+  const bool punch_hole_free_segment_;
+  const bool prefetch_;
 
   char *pmem_;
+  // Max alignment that a segment start address can guarantee
+  uint64_t max_alignment_;
   std::atomic<uint64_t> offset_head_;
-  SpaceEntryPool pool_;
-
-  std::vector<ThreadCache> thread_cache_;
+  SpaceEntryPool<AllocatorMutex> pool_;
+  // Number of blocks of each segment that are not in free lists in low 32 bits,
+  // a segment that is thread owned or not allocated yet counts all its blocks,
+  // and reuse count in high 32 bits. Padded as they are updated on Free and
+  // free list reuse by all threads
+  FixVector<CacheAlignedAtomic<uint64_t>> segment_live_blocks_;
+  // Segment live blocks observed by last reclamation sweep, only accessed by
+  // background thread
+  std::vector<uint64_t> last_segment_live_blocks_;
+  // Reclaimed segments that can be reused by AllocateSegmentSpace
+  std::vector<uint64_t> free_segments_;
+  AllocatorMutex free_segments_lock_;
+
+  std::vector<ThreadCache<AllocatorMutex>> thread_cache_;
   std::shared_ptr<ThreadManager> thread_manager_;
   std::vector<std::thread> bg_threads_;
   // For quickly get corresponding block size of a requested data size
   std::vector<uint16_t> data_size_2_block_size_;
 
   bool closing_;
+
+#ifdef PMEM_ALLOCATOR_INSTRUMENTATION
+  Instrumentation instrumentation_;
+#endif
 };
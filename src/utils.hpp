@@ -4,10 +4,19 @@
 
 #pragma once
 
-#include <atomic>
-#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string.h>
 
 #define PATH_MAX 255
 
@@ -76,6 +85,94 @@ public:
   SpinMutex() : locked(ATOMIC_FLAG_INIT) {}
 };
 
+// Test-and-test-and-set lock with exponential backoff. A waiter spins on a
+// local read of the lock word and only issues an atomic RMW when the lock
+// looks free, so waiting threads don't keep stealing the cache line from the
+// owner. After kSpinRounds unsuccessful backoff rounds the waiter sleeps on a
+// futex, which prevents burning the CPU of a preempted owner on oversubscribed
+// hosts.
+//
+// Lock word: 0 unlocked, 1 locked, 2 locked and may have sleeping waiters
+class BackoffMutex {
+private:
+  static constexpr uint32_t kSpinRounds = 10;
+  static constexpr uint32_t kMaxBackoff = 1024;
+
+  std::atomic<uint32_t> state_;
+
+  void futex_wait(uint32_t expected) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&state_),
+            FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+  }
+
+  void futex_wake() {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&state_),
+            FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+  }
+
+public:
+  void lock() {
+    if (try_lock()) {
+      return;
+    }
+
+    uint32_t backoff = 1;
+    for (uint32_t round = 0; round < kSpinRounds; round++) {
+      for (uint32_t i = 0; i < backoff; i++) {
+        asm volatile("pause");
+      }
+      if (try_lock()) {
+        return;
+      }
+      backoff = std::min(backoff << 1, kMaxBackoff);
+    }
+
+    // Mark the lock as contended before sleeping so the owner wakes us up
+    while (state_.exchange(2, std::memory_order_acquire) != 0) {
+      futex_wait(2);
+    }
+  }
+
+  void unlock() {
+    if (state_.exchange(0, std::memory_order_release) == 2) {
+      futex_wake();
+    }
+  }
+
+  bool try_lock() {
+    uint32_t expected = 0;
+    return state_.load(std::memory_order_relaxed) == 0 &&
+           state_.compare_exchange_strong(expected, 1,
+                                          std::memory_order_acquire,
+                                          std::memory_order_relaxed);
+  }
+
+  BackoffMutex(const BackoffMutex &s) : state_(0) {}
+
+  BackoffMutex(const BackoffMutex &&s) : state_(0) {}
+
+  BackoffMutex() : state_(0) {}
+};
+
+// Pad a lock to a dedicated cache line, so locks stored contiguously (e.g. in
+// a FixVector) don't false-share with each other
+template <typename Mutex> struct alignas(64) CacheAlignedMutex : public Mutex {
+  CacheAlignedMutex() : Mutex() {}
+
+  CacheAlignedMutex(const CacheAlignedMutex &s) : Mutex() {}
+};
+
+static_assert(sizeof(CacheAlignedMutex<SpinMutex>) == 64);
+static_assert(sizeof(CacheAlignedMutex<BackoffMutex>) == 64);
+
+// Pad an atomic counter to a dedicated cache line, so counters updated by
+// different threads don't false-share with each other
+template <typename T> struct alignas(64) CacheAlignedAtomic : std::atomic<T> {
+  CacheAlignedAtomic() : std::atomic<T>() {}
+};
+
+static_assert(sizeof(CacheAlignedAtomic<uint32_t>) == 64);
+
 static bool CheckDevDaxAndGetSize(const char *path, uint64_t *size) {
   char spath[PATH_MAX];
   char npath[PATH_MAX];
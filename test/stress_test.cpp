@@ -0,0 +1,435 @@
+/* SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2021 Intel Corporation
+ */
+
+// Concurrent stress test of PMemAllocatorImpl on a DRAM backed space.
+//
+// Worker threads run randomized allocate / reallocate / free / cross-thread
+// free schedules with mixed sizes, alignments and hints, while the background
+// thread keeps moving free lists and reclaiming segments. Every allocated
+// block is checked against a shadow interval map of live blocks, so
+// overlapping allocations are detected immediately, and each block carries a
+// stamp that is verified before it is freed or reallocated.
+//
+// Before the randomized run, deterministic checks on small dedicated pools
+// verify that fully freed segments are reclaimed and reused for other block
+// sizes, that aligned allocations are aligned, and that reallocation extends
+// blocks in place when the following space is available.
+//
+// Usage: allocator_stress_test [threads] [seconds] [seed] [prefetch]
+//
+// seed 0 means a time based seed, prefetch 1 enables prefetch mode
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "pmem_allocator_impl.hpp"
+
+namespace {
+
+constexpr uint64_t kPMemSize = 1ULL << 30;
+constexpr uint64_t kSegmentSize = 1ULL << 16;
+constexpr uint32_t kAllocationUnit = 32;
+constexpr uint64_t kMaxLiveBlocksPerThread = 4096;
+// Deterministic checks run on a small pool with frequent background sweeps
+constexpr uint64_t kCheckPMemSize = kSegmentSize * 64;
+constexpr float kCheckBgInterval = 0.01;
+
+struct Block {
+  PMemSpaceEntry entry;
+  uint64_t stamp;
+};
+
+class ShadowMap {
+public:
+  // Record a newly allocated block, return false if it overlaps a live block
+  bool Insert(const PMemSpaceEntry &entry) {
+    uint64_t start = (uint64_t)entry.addr;
+    uint64_t end = start + entry.size;
+    std::lock_guard<std::mutex> lg(mu_);
+    auto next = live_.lower_bound(start);
+    if (next != live_.end() && next->first < end) {
+      return false;
+    }
+    if (next != live_.begin()) {
+      auto prev = std::prev(next);
+      if (prev->first + prev->second > start) {
+        return false;
+      }
+    }
+    live_.emplace_hint(next, start, entry.size);
+    return true;
+  }
+
+  // Should be called before the block is returned to allocator
+  bool Erase(const PMemSpaceEntry &entry) {
+    std::lock_guard<std::mutex> lg(mu_);
+    auto it = live_.find((uint64_t)entry.addr);
+    if (it == live_.end() || it->second != entry.size) {
+      return false;
+    }
+    live_.erase(it);
+    return true;
+  }
+
+private:
+  std::mutex mu_;
+  std::map<uint64_t, uint64_t> live_;
+};
+
+class StressTest {
+public:
+  StressTest(uint32_t threads, uint32_t seconds, uint64_t seed, bool prefetch)
+      : threads_(threads), seconds_(seconds), seed_(seed) {
+    pmem_ = (char *)mmap(nullptr, kPMemSize, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (pmem_ == MAP_FAILED) {
+      fprintf(stderr, "mmap DRAM space failed\n");
+      std::abort();
+    }
+    PMemAllocatorHint hint(kSegmentSize, kAllocationUnit, 1);
+    hint.prefetch = prefetch;
+    // The allocator unmaps the space on destruction
+    allocator_ = new PMemAllocatorImpl(pmem_, kPMemSize, threads_, hint);
+  }
+
+  ~StressTest() { delete allocator_; }
+
+  bool Run() {
+    std::vector<std::thread> ths;
+    for (uint32_t i = 0; i < threads_; i++) {
+      ths.emplace_back(&StressTest::Worker, this, i);
+    }
+    for (uint32_t s = 0; s < seconds_ && !failed_; s++) {
+      sleep(1);
+      printf("%lu ops\n", ops_.load());
+    }
+    done_ = true;
+    for (auto &t : ths) {
+      t.join();
+    }
+    // Free blocks left in handoff queue
+    for (auto &block : handoff_) {
+      Release(block);
+    }
+    return !failed_;
+  }
+
+private:
+  void Fail(const char *msg, const PMemSpaceEntry &entry) {
+    fprintf(stderr, "FAILED: %s, addr %p size %lu\n", msg, entry.addr,
+            entry.size);
+    failed_ = true;
+  }
+
+  // Write a stamp to head and tail of block
+  void Stamp(Block &block) {
+    uint64_t *head = (uint64_t *)block.entry.addr;
+    uint64_t *tail =
+        (uint64_t *)((char *)block.entry.addr + block.entry.size) - 1;
+    *head = block.stamp;
+    *tail = ~block.stamp;
+  }
+
+  bool CheckStamp(const Block &block) {
+    uint64_t *head = (uint64_t *)block.entry.addr;
+    uint64_t *tail =
+        (uint64_t *)((char *)block.entry.addr + block.entry.size) - 1;
+    return *head == block.stamp && *tail == ~block.stamp;
+  }
+
+  bool Acquire(const PMemSpaceEntry &entry, uint64_t size, uint64_t alignment,
+               uint64_t stamp, Block *block) {
+    if (entry.addr == nullptr) {
+      // Space exhausted is acceptable, caller will free some blocks
+      return false;
+    }
+    if ((char *)entry.addr < pmem_ ||
+        (char *)entry.addr + entry.size > pmem_ + kPMemSize) {
+      Fail("block out of space", entry);
+      return false;
+    }
+    if (entry.size < size || entry.size % kAllocationUnit != 0) {
+      Fail("wrong block size", entry);
+      return false;
+    }
+    if ((uint64_t)entry.addr % alignment != 0) {
+      Fail("misaligned block", entry);
+      return false;
+    }
+    if (!shadow_.Insert(entry)) {
+      Fail("overlapped block", entry);
+      return false;
+    }
+    block->entry = entry;
+    block->stamp = stamp;
+    Stamp(*block);
+    return true;
+  }
+
+  void Release(const Block &block) {
+    if (!CheckStamp(block)) {
+      Fail("block corrupted", block.entry);
+    }
+    if (!shadow_.Erase(block.entry)) {
+      Fail("freeing unknown block", block.entry);
+    }
+    allocator_->Free(block.entry);
+  }
+
+  // Resize a block, its head stamp should be preserved
+  void Reallocate(Block &block, uint64_t size) {
+    if (!CheckStamp(block)) {
+      Fail("block corrupted", block.entry);
+      return;
+    }
+    if (!shadow_.Erase(block.entry)) {
+      Fail("reallocating unknown block", block.entry);
+      return;
+    }
+    PMemSpaceEntry entry = allocator_->Reallocate(block.entry, size);
+    if (entry.addr == nullptr) {
+      // Space exhausted, the old block is still valid
+      shadow_.Insert(block.entry);
+      return;
+    }
+    if (*(uint64_t *)entry.addr != block.stamp) {
+      Fail("data lost while reallocating", entry);
+      return;
+    }
+    Acquire(entry, size, 1, block.stamp, &block);
+  }
+
+  void Worker(uint32_t tid) {
+    std::mt19937_64 rnd(seed_ + tid);
+    std::vector<Block> live;
+    uint64_t seq = 0;
+    while (!done_ && !failed_) {
+      // Shift block sizes over time to exercise segment reclamation
+      uint64_t max_size = (seq / 100000) % 2 == 0 ? 128 : 4096;
+      uint64_t size = rnd() % max_size + 1;
+      uint64_t stamp = ((uint64_t)tid << 48) | seq++;
+      uint32_t op = rnd() % 9;
+
+      if (live.size() >= kMaxLiveBlocksPerThread || op < 2) {
+        // Free a random live block
+        if (!live.empty()) {
+          size_t i = rnd() % live.size();
+          Release(live[i]);
+          live[i] = live.back();
+          live.pop_back();
+        }
+      } else if (op == 2) {
+        // Hand a block over to be freed by another thread
+        if (!live.empty()) {
+          std::lock_guard<std::mutex> lg(handoff_mu_);
+          handoff_.push_back(live.back());
+          live.pop_back();
+        }
+      } else if (op == 3) {
+        Block block;
+        {
+          std::lock_guard<std::mutex> lg(handoff_mu_);
+          if (handoff_.empty()) {
+            continue;
+          }
+          block = handoff_.back();
+          handoff_.pop_back();
+        }
+        Release(block);
+      } else if (op == 8) {
+        if (!live.empty()) {
+          Reallocate(live[rnd() % live.size()], size);
+        }
+      } else {
+        Block block;
+        PMemSpaceEntry entry;
+        uint64_t alignment = 1;
+        if (op == 4) {
+          alignment = 1ULL << (rnd() % 13);
+          entry = allocator_->AllocateAligned(size, alignment);
+        } else if (op == 5) {
+          auto lifetime = rnd() % 2 ? PMemAllocationHint::Lifetime::Long
+                                    : PMemAllocationHint::Lifetime::Short;
+          entry = allocator_->Allocate(size,
+                                       PMemAllocationHint(lifetime, rnd() % 4));
+        } else {
+          entry = allocator_->Allocate(size);
+        }
+        if (Acquire(entry, size, alignment, stamp, &block)) {
+          live.push_back(block);
+        } else if (!live.empty()) {
+          Release(live.back());
+          live.pop_back();
+        }
+      }
+      ops_.fetch_add(1, std::memory_order_relaxed);
+    }
+    for (auto &block : live) {
+      Release(block);
+    }
+  }
+
+  const uint32_t threads_;
+  const uint32_t seconds_;
+  const uint64_t seed_;
+  char *pmem_;
+  PMemAllocatorImpl *allocator_;
+  ShadowMap shadow_;
+  std::mutex handoff_mu_;
+  std::vector<Block> handoff_;
+  std::atomic<uint64_t> ops_{0};
+  std::atomic<bool> done_{false};
+  std::atomic<bool> failed_{false};
+};
+
+// Each check runs in its own thread on a fresh allocator, so the thread gets an
+// access thread id and empty caches of that allocator
+class DeterministicChecks {
+public:
+  bool Run() {
+    return RunCheck("segment reclamation", &DeterministicChecks::Reclaim) &&
+           RunCheck("aligned allocation", &DeterministicChecks::Aligned) &&
+           RunCheck("in place reallocation",
+                    &DeterministicChecks::ReallocateInPlace);
+  }
+
+private:
+  bool RunCheck(const char *name, bool (DeterministicChecks::*check)()) {
+    char *pmem = (char *)mmap(nullptr, kCheckPMemSize, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pmem == MAP_FAILED) {
+      fprintf(stderr, "mmap DRAM space failed\n");
+      return false;
+    }
+    PMemAllocatorHint hint(kSegmentSize, kAllocationUnit, 1);
+    hint.bg_thread_interval = kCheckBgInterval;
+    allocator_ = new PMemAllocatorImpl(pmem, kCheckPMemSize, 1, hint);
+    bool ok;
+    std::thread t([&]() { ok = (this->*check)(); });
+    t.join();
+    delete allocator_;
+    printf("Check %s %s\n", name, ok ? "passed" : "FAILED");
+    return ok;
+  }
+
+  // Fill the pool with small blocks and free them all, after a sweep the
+  // space should be available to large blocks
+  bool Reclaim() {
+    constexpr uint64_t kSmallSize = 64;
+    constexpr uint64_t kLargeSize = 4096;
+    std::vector<PMemSpaceEntry> blocks;
+    while (true) {
+      PMemSpaceEntry entry = allocator_->Allocate(kSmallSize);
+      if (entry.addr == nullptr) {
+        break;
+      }
+      blocks.push_back(entry);
+    }
+    if (blocks.size() * kSmallSize < kCheckPMemSize / 2) {
+      fprintf(stderr, "only %lu small blocks allocated\n", blocks.size());
+      return false;
+    }
+    for (auto &entry : blocks) {
+      allocator_->Free(entry);
+    }
+    blocks.clear();
+    // Wait several background sweeps
+    usleep(kCheckBgInterval * 20 * 1000000);
+    while (true) {
+      PMemSpaceEntry entry = allocator_->Allocate(kLargeSize);
+      if (entry.addr == nullptr) {
+        break;
+      }
+      blocks.push_back(entry);
+    }
+    if (blocks.size() * kLargeSize < kCheckPMemSize / 2) {
+      fprintf(stderr, "only %lu large blocks allocated after reclamation\n",
+              blocks.size());
+      return false;
+    }
+    for (auto &entry : blocks) {
+      allocator_->Free(entry);
+    }
+    return true;
+  }
+
+  bool Aligned() {
+    for (uint64_t alignment = 1; alignment <= 4096; alignment <<= 1) {
+      for (uint64_t size : {1, 100, 1000, 4000}) {
+        PMemSpaceEntry entry = allocator_->AllocateAligned(size, alignment);
+        if (entry.addr == nullptr || entry.size < size ||
+            (uint64_t)entry.addr % alignment != 0) {
+          fprintf(stderr, "bad block %p size %lu for size %lu alignment %lu\n",
+                  entry.addr, entry.size, size, alignment);
+          return false;
+        }
+        allocator_->Free(entry);
+      }
+    }
+    return true;
+  }
+
+  bool ReallocateInPlace() {
+    // The block is followed by the remaining space of its thread segment
+    PMemSpaceEntry entry = allocator_->Allocate(64);
+    PMemSpaceEntry resized = allocator_->Reallocate(entry, 1024);
+    if (resized.addr != entry.addr || resized.size < 1024) {
+      fprintf(stderr, "block %p not extended by segment, got %p\n", entry.addr,
+              resized.addr);
+      return false;
+    }
+    allocator_->Free(resized);
+
+    // The block is followed by a freed neighbor
+    PMemSpaceEntry first = allocator_->Allocate(96);
+    PMemSpaceEntry second = allocator_->Allocate(96);
+    if ((char *)second.addr != (char *)first.addr + first.size) {
+      fprintf(stderr, "blocks %p and %p are not adjacent\n", first.addr,
+              second.addr);
+      return false;
+    }
+    allocator_->Free(second);
+    resized = allocator_->Reallocate(first, 192);
+    if (resized.addr != first.addr || resized.size < 192) {
+      fprintf(stderr, "block %p not extended by neighbor, got %p\n",
+              first.addr, resized.addr);
+      return false;
+    }
+    allocator_->Free(resized);
+    return true;
+  }
+
+  PMemAllocatorImpl *allocator_;
+};
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  uint32_t threads = argc > 1 ? atoi(argv[1]) : 8;
+  uint32_t seconds = argc > 2 ? atoi(argv[2]) : 5;
+  uint64_t seed = argc > 3 ? strtoull(argv[3], nullptr, 10) : 0;
+  bool prefetch = argc > 4 ? atoi(argv[4]) != 0 : false;
+  if (seed == 0) {
+    seed = time(nullptr);
+  }
+  printf("Stress test with %u threads for %u seconds, seed %lu, prefetch %d\n",
+         threads, seconds, seed, prefetch);
+  if (!DeterministicChecks().Run()) {
+    return 1;
+  }
+  StressTest test(threads, seconds, seed, prefetch);
+  if (!test.Run()) {
+    return 1;
+  }
+  printf("Stress test passed\n");
+  return 0;
+}